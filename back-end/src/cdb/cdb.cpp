@@ -1,18 +1,31 @@
 //Copyright 2018-2019 Patrick Laughrea
 #include "cdb.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <climits>
 #include <cstring>
+#include <ctime>
 #include <exception>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <regex>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <boost/filesystem/fstream.hpp>
 
 using namespace cdb;
@@ -21,14 +34,23 @@ namespace fs = boost::filesystem;
 
 static const char* PATH_BMKS = ".cdb";
 static const char* FILE_BMKS = "bmks";
+static const char* FILE_INDEX = "index";
+static const char* FILE_NO_STORES = "nostores";
+
+static const size_t MAX_CHECK_THREADS = 64;
+static const size_t MAX_NO_STORES = 4096;
+static const int MAX_BMK_DEPTH = 32;
 
-static string* errMsg = nullptr;
+static thread_local string errMsg;
+static thread_local int bmkDepth = 0;
 static char* lastBmk;
+static bool walkLocal = false;
 
 static bool resolvePathWildcard(fs::path& p, PathPart pathPart, char* ptr1, char* ptr2, const bool BASH_COMPLETION);
 static void updatePathsWildcard(list<fs::path>& paths, PathPart pathPart, const char* item, bool hasWildcard);
 static void setToPathBmks(fs::path& p);
 static fs::path getFileBmks(const fs::path& p);
+static fs::path getFileIndex(const fs::path& p);
 static int getToBmkPath(fs::ifstream& in, const char* bmk);
 static bool getBmk(fs::path& p, const char* bmk);
 static bool resolveBmkPath(fs::path& p, fs::ifstream& in);
@@ -43,6 +65,41 @@ static bool isBmkNameStart(char c);
 static bool isBmkNameBody(char c);
 static bool isAbsolute(const char* path);
 
+//the index maps each bookmark name to the canonical path it resolves to
+//a bookmark that goes through other bookmarks, or that can't be resolved, keeps its value, which is resolved at each lookup
+struct IndexEntry {
+	string name, path;
+	bool isValue;
+};
+typedef vector<IndexEntry> Index;
+static IndexEntry makeIndexEntry(const fs::path& basePath, const string& name, const string& value);
+static bool resolveBmkValue(const fs::path& basePath, const string& value, string& canonicalPath);
+static bool leadsTo(const fs::path& basePath, const IndexEntry& entry, const fs::path& target);
+static string getStamp(const fs::path& file);
+static bool readIndex(const fs::path& basePath, Index& index);
+static void buildIndex(const fs::path& basePath, Index& index);
+static void writeIndex(const fs::path& basePath, const Index& index, const string& stamp);
+static void removeIndex(const fs::path& basePath);
+static bool isSameOrAncestor(const string& dir, const string& path);
+static string makeBmkPath(const fs::path& basePath, const char* pathVal, fs::path& newBmkPath);
+static void appendBmks(const fs::path& basePath, const string& lines, const vector<pair<string, string>>& added);
+static string checkBmk(const fs::path& basePath, string pathVal);
+
+//the dirs known to have no bookmarks, each with its last write time when that was checked
+//they are read once per process and written once at exit, and they can be used by several threads
+typedef unordered_map<string, time_t> NoStores;
+static NoStores noStores;
+static bool isNoStoresRead = false, isNoStoresChanged = false;
+static mutex noStoresMutex;
+static void setToLocalStore(fs::path& p, const char* path, const bool BASH_COMPLETION);
+static bool isNoStore(const fs::path& dir, time_t lastWrite);
+static void addNoStore(const fs::path& dir, time_t lastWrite);
+static void cacheIfNoStore(const fs::path& dir, time_t lastWrite, time_t now);
+static bool hasBmkStartingWith(fs::ifstream& in, const string& prefix);
+static fs::path getFileNoStores();
+static void readNoStores();
+static void writeNoStores();
+
 #ifndef NDEBUG
 #define debug(msg) std::cerr << msg << std::endl
 #else
@@ -54,9 +111,11 @@ bool cdb::resolvePath(fs::path& p, char* path, const bool BASH_COMPLETION) {
 	assert(fs::is_directory(p) && path != nullptr);
 	PathPart pathPart;
 	char* ptr1 = path;
-	if (*ptr1 == CHAR_ROOT_LOCAL)
+	if (*ptr1 == CHAR_ROOT_LOCAL) {
+		if (walkLocal)
+			setToLocalStore(p, ptr1 + 1, BASH_COMPLETION);
 		goto charBmkDir;
-	else if (*ptr1 == CHAR_CURR_DIR) {
+	} else if (*ptr1 == CHAR_CURR_DIR) {
 		pathPart = PathPart::DIR;
 		goto pathEnd;
 	} else if (*ptr1 == CHAR_ROOT_USER) {
@@ -105,6 +164,10 @@ pathEnd:
 	}
 }
 
+void cdb::setWalkLocal(bool walk) {
+	walkLocal = walk;
+}
+
 fs::path cdb::getPathHome() {
 	const char* home = getenv("HOME");
 	if (home == nullptr)
@@ -128,8 +191,7 @@ void cdb::printBashCompletion(const fs::path& p, PathPart pathPart, const char*
 }
 
 std::string& cdb::getErrMsg() {
-	assert(errMsg != nullptr);
-	return *errMsg;
+	return errMsg;
 }
 
 //this checks if path ends with "/.", like "/parent/dir-name/.", and does not count that in the path length
@@ -182,15 +244,230 @@ void cdb::addBmk(const boost::filesystem::path& basePath, const char* name, cons
 	assert(fs::is_directory(basePath) && name != nullptr && pathVal != nullptr);
 	if (!bmkNameValid(name))
 		throw runtime_error("name is not valid");
+	fs::path newBmkPath;
+	auto bmkPath = makeBmkPath(basePath, pathVal, newBmkPath);
+	
+	auto fileBmks = getFileBmks(basePath);
+	if (fs::is_regular_file(fileBmks)) {
+		fs::ifstream in(fileBmks, std::ios::in);
+		if (!in)
+			throw runtime_error("error reading bookmarks file");
+		if (getToBmkPath(in, name) != -1)
+			throw runtime_error("bookmark already exists");
+	}
+	appendBmks(basePath, string(name) + '=' + bmkPath + '\n', {{name, bmkPath}});
+}
+
+void cdb::addBmks(const boost::filesystem::path& basePath, istream& in, vector<string>& errors, const bool ALL_OR_NOTHING) {
+	assert(fs::is_directory(basePath));
+	unordered_set<string> names;
+	{
+		fs::ifstream inBmks(getFileBmks(basePath), std::ios::in);
+		string line;
+		while (getline(inBmks, line))
+			names.insert(line.substr(0, line.find('=')));
+	}
+	
+	string lines;
+	vector<pair<string, string>> added;
+	string line;
+	for (int lineNum = 1; getline(in, line); ++lineNum) {
+		if (line.empty())
+			continue;
+		auto pos = line.find('=');
+		auto name = line.substr(0, pos);
+		try {
+			if (pos == string::npos)
+				throw runtime_error("expected name=path");
+			if (!bmkNameValid(name.c_str()))
+				throw runtime_error("name is not valid");
+			if (names.count(name) != 0)
+				throw runtime_error("bookmark already exists");
+			fs::path newBmkPath;
+			auto bmkPath = makeBmkPath(basePath, line.c_str() + pos + 1, newBmkPath);
+			lines += name + '=' + bmkPath + '\n';
+			added.emplace_back(name, bmkPath);
+			names.insert(move(name));
+		} catch (const exception& e) {
+			errors.push_back("line " + to_string(lineNum) + ": " + name + ": " + e.what());
+		}
+	}
+	if (!in.eof())
+		throw runtime_error("bookmarks were not added: an I/O error occurred");
+	if (added.empty() || (ALL_OR_NOTHING && !errors.empty()))
+		return;
+	appendBmks(basePath, lines, added);
+}
+
+void cdb::exportBmks(const boost::filesystem::path& basePath, ostream& out) {
+	assert(fs::is_directory(basePath));
+	fs::ifstream in(getFileBmks(basePath), std::ios::in);
+	if (!in)
+		throw runtime_error("error reading bookmarks file");
+	if (in.peek() != EOF)
+		out << in.rdbuf();
+	if (out.fail())
+		throw runtime_error("bookmarks were not exported: an I/O error occurred");
+}
+
+void cdb::rmBmk(const boost::filesystem::path& basePath, const char* name) {
+	auto fileBmks = getFileBmks(basePath);
+	fs::ifstream in(fileBmks, std::ios::in);
+	if (!in)
+		throw runtime_error("error reading bookmarks file");
+	int line = getToBmkPath(in, name);
+	if (line == -1)
+		throw runtime_error("no such bookmark");
+	Index index;
+	bool hasIndex = readIndex(basePath, index);
+	fs::path tempPath(fileBmks.native() + "temp");
+	fs::ofstream out(tempPath, std::ios::out);
+	if (!out)
+		throw runtime_error("bookmark was not removed: could not open a temporary file");
+	in.seekg(0);
+	char c;
+	if (line != 0) {
+		int inLine = 0;
+		for (c = in.get(); in.good(); c = in.get()) {
+			out.put(c);
+			if (c == '\n' && ++inLine  == line)
+				break;
+		}
+	}
+	for (c = in.get(); in.good() && c != '\n'; c = in.get())
+		;
+	for (c = in.get(); in.good(); c = in.get())
+		out.put(c);
+	if (!in.eof() || out.fail()) {
+		out.close();
+		fs::remove(tempPath);
+		throw runtime_error("bookmark was not removed: an I/O error occurred");
+	}
+	in.close();
+	out.close();
+	fs::rename(tempPath, fileBmks);
+	
+	if (!hasIndex)
+		return removeIndex(basePath);
+	for (auto it = index.begin(); it != index.end();)
+		it = it->name == name ? index.erase(it) : ++it;
+	writeIndex(basePath, index, getStamp(fileBmks));
+}
+
+vector<string> cdb::getBmksTo(const fs::path& basePath, const fs::path& target) {
+	assert(fs::is_directory(basePath) && target.is_absolute());
+	Index index;
+	if (!readIndex(basePath, index))
+		buildIndex(basePath, index);
+	vector<string> names;
+	for (const auto& entry : index)
+		if (leadsTo(basePath, entry, target))
+			names.push_back(entry.name);
+	return names;
+}
+
+vector<string> cdb::getLocalBmksTo(const fs::path& target, const fs::path& excluded) {
+	assert(fs::is_directory(target) && target.is_absolute());
+	if (!walkLocal)
+		return target == excluded ? vector<string>() : getBmksTo(target, target);
+	//the stores are used in the same order as setToLocalStore; a name defined in a nearer store hides the farther ones
+	vector<string> names;
+	unordered_set<string> hidden;
+	auto now = time(nullptr);
+	for (auto dir = target; !dir.empty(); dir = dir.parent_path()) {
+		boost::system::error_code ec;
+		auto lastWrite = fs::last_write_time(dir, ec);
+		if (ec)
+			break;
+		if (isNoStore(dir, lastWrite))
+			continue;
+		Index index;
+		if (!readIndex(dir, index)) {
+			if (!fs::is_regular_file(getFileBmks(dir), ec)) {
+				cacheIfNoStore(dir, lastWrite, now);
+				continue;
+			}
+			buildIndex(dir, index);
+		}
+		for (const auto& entry : index)
+			if (hidden.insert(entry.name).second && dir != excluded && leadsTo(dir, entry, target))
+				names.push_back(entry.name);
+	}
+	return names;
+}
+
+//the bookmarks are resolved by a pool of threads, so that their checks wait on the file system together
+void cdb::checkBmks(const fs::path& basePath, vector<string>& errors) {
+	assert(fs::is_directory(basePath));
+	fs::ifstream in(getFileBmks(basePath), std::ios::in);
+	if (!in)
+		throw runtime_error("error reading bookmarks file");
+	vector<pair<string, string>> bmks;
+	string line;
+	while (getline(in, line)) {
+		auto pos = line.find('=');
+		if (pos != string::npos)
+			bmks.emplace_back(line.substr(0, pos), line.substr(pos + 1));
+	}
+	if (!in.eof())
+		throw runtime_error("reading bookmarks file failed: an I/O error occurred");
+	
+	vector<string> results(bmks.size());
+	atomic<size_t> next(0);
+	auto check = [&]() {
+		for (size_t i; (i = next++) < bmks.size();)
+			results[i] = checkBmk(basePath, bmks[i].second);
+	};
+	vector<thread> threads;
+	auto numThreads = min(bmks.size(), MAX_CHECK_THREADS);
+	for (size_t i = 1; i < numThreads; ++i) {
+		try {
+			threads.emplace_back(check);
+		} catch (const system_error&) {
+			break; //the threads already started do the rest
+		}
+	}
+	check();
+	for (auto& t : threads)
+		t.join();
+	for (size_t i = 0; i < bmks.size(); ++i)
+		if (!results[i].empty())
+			errors.push_back(bmks[i].first + ": " + results[i]);
+}
+
+void cdb::prefetchDir(const fs::path& p, unsigned long budget) {
+	assert(fs::is_directory(p));
+	if (budget == 0)
+		return;
+	int fd = open(getFileBmks(p).c_str(), O_RDONLY);
+	if (fd != -1) {
+		--budget;
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#else
+		char buf[4096];
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+#endif
+		close(fd);
+	}
+	boost::system::error_code ec;
+	for (fs::directory_iterator it(p, ec), end; !ec && it != end && budget > 0; it.increment(ec), --budget)
+		it->status(ec);
+}
+
+//puts in newBmkPath the dir that pathVal leads to and returns the path to write for it in the bookmarks of basePath
+static string makeBmkPath(const fs::path& basePath, const char* pathVal, fs::path& newBmkPath) {
+	assert(fs::is_directory(basePath) && pathVal != nullptr);
 	auto pathValLength = strlen(pathVal);
 	if (pathValLength >= PATH_MAX)
 		throw runtime_error("path value is too long");
 	
 	//TODO: PATH_MAX should be the max length of the newBmkPath path (like <bmk name>=<newBmkPath path>)
 	
-	fs::path newBmkPath = fs::current_path();
+	newBmkPath = fs::current_path();
 	{
-		unique_ptr<char> pathValCopy(new char[pathValLength]);
+		unique_ptr<char[]> pathValCopy(new char[pathValLength + 1]);
 		strcpy(pathValCopy.get(), pathVal);
 		if (!resolvePath(newBmkPath, pathValCopy.get()))
 			throw runtime_error(move(getErrMsg()));
@@ -260,15 +537,15 @@ void cdb::addBmk(const boost::filesystem::path& basePath, const char* name, cons
 			}
 		}
 	}
-	
+	return bmkPath;
+}
+
+//creates the bookmarks file of basePath if needed, then appends lines to it in one rewrite
+//added contains the names and values of the new bookmarks, to update the index
+static void appendBmks(const fs::path& basePath, const string& lines, const vector<pair<string, string>>& added) {
+	assert(fs::is_directory(basePath));
 	auto fileBmks = getFileBmks(basePath);
-	if (fs::is_regular_file(fileBmks)) {
-		fs::ifstream in(fileBmks, std::ios::in);
-		if (!in)
-			throw runtime_error("error reading bookmarks file");
-		if (getToBmkPath(in, name) != -1)
-			throw runtime_error("bookmark already exists");
-	} else {
+	if (!fs::is_regular_file(fileBmks)) {
 		auto bmksDir = basePath;
 		setToPathBmks(bmksDir);
 		fs::create_directory(bmksDir);
@@ -276,12 +553,14 @@ void cdb::addBmk(const boost::filesystem::path& basePath, const char* name, cons
 		if (!out)
 			throw runtime_error("bookmark was not added: could not create bookmarks file");
 	}
+	Index index;
+	bool hasIndex = readIndex(basePath, index);
 	fs::path tempPath(fileBmks.native() + "temp");
 	fs::copy_file(fileBmks, tempPath);
 	fs::ofstream out(tempPath, std::ios::app);
 	if (!out)
 		throw runtime_error("bookmark was not added: could not open temporary file to write");
-	out << name << '=' << bmkPath << '\n';
+	out << lines;
 	if (out.fail()) {
 		out.close();
 		fs::remove(tempPath);
@@ -289,42 +568,12 @@ void cdb::addBmk(const boost::filesystem::path& basePath, const char* name, cons
 	}
 	out.close();
 	fs::rename(tempPath, fileBmks);
-}
-
-void cdb::rmBmk(const boost::filesystem::path& basePath, const char* name) {
-	auto fileBmks = getFileBmks(basePath);
-	fs::ifstream in(fileBmks, std::ios::in);
-	if (!in)
-		throw runtime_error("error reading bookmarks file");
-	int line = getToBmkPath(in, name);
-	if (line == -1)
-		throw runtime_error("no such bookmark");
-	fs::path tempPath(fileBmks.native() + "temp");
-	fs::ofstream out(tempPath, std::ios::out);
-	if (!out)
-		throw runtime_error("bookmark was not removed: could not open a temporary file");
-	in.seekg(0);
-	char c;
-	if (line != 0) {
-		int inLine = 0;
-		for (c = in.get(); in.good(); c = in.get()) {
-			out.put(c);
-			if (c == '\n' && ++inLine  == line)
-				break;
-		}
-	}
-	for (c = in.get(); in.good() && c != '\n'; c = in.get())
-		;
-	for (c = in.get(); in.good(); c = in.get())
-		out.put(c);
-	if (!in.eof() || out.fail()) {
-		out.close();
-		fs::remove(tempPath);
-		throw runtime_error("bookmark was not removed: an I/O error occurred");
-	}
-	in.close();
-	out.close();
-	fs::rename(tempPath, fileBmks);
+	
+	if (!hasIndex)
+		return removeIndex(basePath);
+	for (const auto& bmk : added)
+		index.push_back(makeIndexEntry(basePath, bmk.first, bmk.second));
+	writeIndex(basePath, index, getStamp(fileBmks));
 }
 
 static bool resolvePathWildcard(fs::path& p, PathPart pathPart, char* ptr1, char* ptr2, const bool BASH_COMPLETION) {
@@ -393,6 +642,14 @@ static fs::path getFileBmks(const fs::path& p) {
 	return pCopy;
 }
 
+static fs::path getFileIndex(const fs::path& p) {
+	assert(fs::is_directory(p));
+	fs::path pCopy(p);
+	setToPathBmks(pCopy);
+	pCopy /= FILE_INDEX;
+	return pCopy;
+}
+
 static int getToBmkPath(fs::ifstream& in, const char* bmk) {
 	assert(in.good() && bmk != nullptr);
 	char c;
@@ -423,8 +680,17 @@ eofException:
 	return -1;
 }
 
+//a bookmark can lead to other bookmarks, so the depth is limited to stop cycles like "loop=~:loop"
 static bool getBmk(fs::path& p, const char* bmk) {
 	assert(fs::is_directory(p) && bmk != nullptr);
+	if (bmkDepth >= MAX_BMK_DEPTH) {
+		setErrMsg(string("failed to get bookmark \"") + bmk + "\": bookmark chain too deep or cyclic");
+		return false;
+	}
+	struct DepthGuard {
+		DepthGuard() { ++bmkDepth; }
+		~DepthGuard() { --bmkDepth; }
+	} depthGuard;
 	fs::ifstream in(getFileBmks(p), std::ios::in);
 	if (!in) {
 		setErrMsg("error reading bookmarks file");
@@ -566,9 +832,7 @@ addRegularChar:
 }
 
 static void setErrMsg(string msg) {
-	if (errMsg == nullptr)
-		errMsg = new string();
-	*errMsg = move(msg);
+	errMsg = move(msg);
 }
 
 static void nulToDir(char* ptr1, char* ptr2) {
@@ -606,4 +870,270 @@ static bool isAbsolute(const char* path) {
 	assert(path != nullptr);
 	char c = path[0];
 	return isBmkNameStart(c) || c == CHAR_ROOT_SYSTEM || c == CHAR_ROOT_USER || c == CHAR_WILDCARD;
+}
+
+//puts in p the nearest dir, from p up, whose bookmarks define the first bookmark of path
+//if that bookmark is being completed, a bookmark starting with it is enough
+//if it is empty or has a wildcard, the nearest dir with bookmarks is used; if there is none, p is unchanged
+static void setToLocalStore(fs::path& p, const char* path, const bool BASH_COMPLETION) {
+	assert(fs::is_directory(p) && path != nullptr);
+	const char* end = path;
+	bool anyStore = false;
+	for (; *end != '\0' && *end != CHAR_SEP_BMK && *end != CHAR_SEP_DIR; ++end)
+		if (*end == CHAR_WILDCARD)
+			anyStore = true;
+	if (end == path)
+		anyStore = true;
+	bool isPrefix = BASH_COMPLETION && *end == '\0';
+	string name(path, end);
+	
+	auto now = time(nullptr);
+	for (auto dir = p; !dir.empty(); dir = dir.parent_path()) {
+		boost::system::error_code ec;
+		auto lastWrite = fs::last_write_time(dir, ec);
+		if (ec)
+			break;
+		if (isNoStore(dir, lastWrite))
+			continue;
+		fs::ifstream in(getFileBmks(dir), std::ios::in);
+		if (in) {
+			if (anyStore || (isPrefix ? hasBmkStartingWith(in, name) : getToBmkPath(in, name.c_str()) != -1)) {
+				p = dir;
+				break;
+			}
+		} else
+			cacheIfNoStore(dir, lastWrite, now);
+	}
+}
+
+//the time of dir only changes when its .cdb is created, and not when a bookmarks file is created in an existing .cdb
+//it is not trusted if it is from the current second, since a store created in that second would not change it
+static void cacheIfNoStore(const fs::path& dir, time_t lastWrite, time_t now) {
+	boost::system::error_code ec;
+	if (lastWrite < now && !fs::exists(dir / PATH_BMKS, ec))
+		addNoStore(dir, lastWrite);
+}
+
+//a cached dir whose last write time changed is removed, since a store could have been created in it
+static bool isNoStore(const fs::path& dir, time_t lastWrite) {
+	lock_guard<mutex> lock(noStoresMutex);
+	if (!isNoStoresRead)
+		readNoStores();
+	auto it = noStores.find(dir.native());
+	if (it == noStores.end())
+		return false;
+	if (it->second == lastWrite)
+		return true;
+	noStores.erase(it);
+	isNoStoresChanged = true;
+	return false;
+}
+
+static void addNoStore(const fs::path& dir, time_t lastWrite) {
+	lock_guard<mutex> lock(noStoresMutex);
+	if (!isNoStoresRead)
+		readNoStores();
+	if (noStores.size() >= MAX_NO_STORES)
+		noStores.clear();
+	noStores[dir.native()] = lastWrite;
+	isNoStoresChanged = true;
+}
+
+static bool hasBmkStartingWith(fs::ifstream& in, const string& prefix) {
+	assert(in.good() && !prefix.empty());
+	string line;
+	while (getline(in, line))
+		if (line.compare(0, prefix.length(), prefix) == 0 && line.find('=') >= prefix.length())
+			return true;
+	return false;
+}
+
+static fs::path getFileNoStores() {
+	auto p = getPathHome();
+	setToPathBmks(p);
+	p /= FILE_NO_STORES;
+	return p;
+}
+
+//each line of the file is "<last write time> <dir>"
+//noStoresMutex must be locked
+static void readNoStores() {
+	isNoStoresRead = true;
+	atexit(writeNoStores);
+	try {
+		fs::ifstream in(getFileNoStores(), std::ios::in);
+		time_t lastWrite;
+		string dir;
+		while (in >> lastWrite && in.get() == ' ' && getline(in, dir))
+			noStores[dir] = lastWrite;
+	} catch (const exception&) {
+		noStores.clear();
+	}
+}
+
+//the file is only a cache, so failing to write it is not an error
+//it can be written by several processes at once, so each uses its own temporary file from mkstemp; the last rename wins
+static void writeNoStores() {
+	lock_guard<mutex> lock(noStoresMutex);
+	if (!isNoStoresChanged)
+		return;
+	try {
+		auto fileNoStores = getFileNoStores();
+		boost::system::error_code ec;
+		fs::create_directory(fileNoStores.parent_path(), ec);
+		string content;
+		for (const auto& entry : noStores)
+			content += to_string(entry.second) + ' ' + entry.first + '\n';
+		string tempPath = fileNoStores.native() + "XXXXXX";
+		int fd = mkstemp(&tempPath[0]);
+		if (fd == -1)
+			return;
+		const char* ptr = content.data();
+		for (auto left = content.length(); left > 0;) {
+			auto written = write(fd, ptr, left);
+			if (written <= 0)
+				break;
+			ptr += written;
+			left -= written;
+		}
+		bool failed = ptr != content.data() + content.length();
+		if (close(fd) == -1 || failed || rename(tempPath.c_str(), fileNoStores.c_str()) == -1)
+			unlink(tempPath.c_str());
+	} catch (const exception&) {}
+}
+
+//returns why pathVal does not lead to a dir, or an empty string if it does
+static string checkBmk(const fs::path& basePath, string pathVal) {
+	auto p = basePath;
+	try {
+		if (!resolvePath(p, &pathVal[0]))
+			return move(getErrMsg());
+		if (!fs::is_directory(p))
+			return "not a directory: " + p.native();
+	} catch (const exception& e) {
+		return e.what();
+	}
+	return string();
+}
+
+//the stamp identifies a version of a file; it is empty if the file can't be read
+//the inode changes when a file is replaced, and the time has nanoseconds, so an edit in the same second is seen
+static string getStamp(const fs::path& file) {
+	struct stat st;
+	if (stat(file.c_str(), &st) == -1)
+		return string();
+#ifdef __APPLE__
+	const auto& lastWrite = st.st_mtimespec;
+#else
+	const auto& lastWrite = st.st_mtim;
+#endif
+	return to_string(lastWrite.tv_sec) + '.' + to_string(lastWrite.tv_nsec) + ' ' + to_string(st.st_ino) + ' ' + to_string(st.st_size);
+}
+
+//the first line of the index file is the stamp of the bookmarks file it was built from
+//the other lines are "name=path", or "name:value" for the bookmarks that keep their value
+static bool readIndex(const fs::path& basePath, Index& index) {
+	assert(fs::is_directory(basePath) && index.empty());
+	auto stamp = getStamp(getFileBmks(basePath));
+	if (stamp.empty())
+		return false;
+	fs::ifstream in(getFileIndex(basePath), std::ios::in);
+	string line;
+	if (!in || !getline(in, line) || line != stamp)
+		return false;
+	while (getline(in, line)) {
+		auto pos = line.find_first_of("=:");
+		if (pos == string::npos) {
+			index.clear();
+			return false;
+		}
+		index.push_back(IndexEntry{line.substr(0, pos), line.substr(pos + 1), line[pos] == CHAR_SEP_BMK});
+	}
+	if (!in.eof()) {
+		index.clear();
+		return false;
+	}
+	return true;
+}
+
+static void buildIndex(const fs::path& basePath, Index& index) {
+	assert(fs::is_directory(basePath));
+	index.clear();
+	auto fileBmks = getFileBmks(basePath);
+	auto stamp = getStamp(fileBmks);
+	if (stamp.empty())
+		return;
+	fs::ifstream in(fileBmks, std::ios::in);
+	if (!in)
+		return;
+	string line;
+	while (getline(in, line)) {
+		auto pos = line.find('=');
+		if (pos != string::npos && pos != 0)
+			index.push_back(makeIndexEntry(basePath, line.substr(0, pos), line.substr(pos + 1)));
+	}
+	if (in.eof())
+		writeIndex(basePath, index, stamp);
+}
+
+//the index is only a cache, so failing to write it is not an error
+static void writeIndex(const fs::path& basePath, const Index& index, const string& stamp) {
+	assert(fs::is_directory(basePath));
+	if (stamp.empty())
+		return removeIndex(basePath);
+	auto fileIndex = getFileIndex(basePath);
+	fs::path tempPath(fileIndex.native() + "temp");
+	fs::ofstream out(tempPath, std::ios::out);
+	if (!out)
+		return;
+	out << stamp << '\n';
+	for (const auto& entry : index)
+		out << entry.name << (entry.isValue ? CHAR_SEP_BMK : '=') << entry.path << '\n';
+	out.close();
+	boost::system::error_code ec;
+	if (out.fail())
+		fs::remove(tempPath, ec);
+	else
+		fs::rename(tempPath, fileIndex, ec);
+}
+
+//a value going through other bookmarks is not resolved here, since they can change without changing this bookmarks file
+static IndexEntry makeIndexEntry(const fs::path& basePath, const string& name, const string& value) {
+	string canonicalPath;
+	if (value.find_first_of(":%") != string::npos || isBmkNameStart(value[0]) || !resolveBmkValue(basePath, value, canonicalPath))
+		return IndexEntry{name, value, true};
+	return IndexEntry{name, move(canonicalPath), false};
+}
+
+static bool resolveBmkValue(const fs::path& basePath, const string& value, string& canonicalPath) {
+	assert(fs::is_directory(basePath));
+	vector<char> pathVal(value.begin(), value.end());
+	pathVal.push_back('\0');
+	auto p = basePath;
+	try {
+		if (!resolvePath(p, pathVal.data()))
+			return false;
+		canonicalPath = fs::canonical(p).native();
+	} catch (const exception&) {
+		return false;
+	}
+	return true;
+}
+
+static bool leadsTo(const fs::path& basePath, const IndexEntry& entry, const fs::path& target) {
+	if (!entry.isValue)
+		return isSameOrAncestor(entry.path, target.native());
+	string path;
+	return resolveBmkValue(basePath, entry.path, path) && isSameOrAncestor(path, target.native());
+}
+
+static void removeIndex(const fs::path& basePath) {
+	boost::system::error_code ec;
+	fs::remove(getFileIndex(basePath), ec);
+}
+
+static bool isSameOrAncestor(const string& dir, const string& path) {
+	if (dir.empty() || path.compare(0, dir.length(), dir) != 0)
+		return false;
+	return path.length() == dir.length() || dir.back() == CHAR_SEP_DIR || path[dir.length()] == CHAR_SEP_DIR;
 }
\ No newline at end of file
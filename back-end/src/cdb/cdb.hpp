@@ -1,5 +1,10 @@
 //Copyright 2018-2019 Patrick Laughrea
 
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
 #include <boost/filesystem.hpp>
 
 namespace cdb {
@@ -18,9 +23,32 @@ namespace cdb {
 	//NOTE: path might change! Make a copy if you wish to keep the original
 	bool resolvePath(boost::filesystem::path& p, char* path, const bool BASH_COMPLETION = false);
 	
+	//if walk, a path starting with a local bookmark uses the bookmarks of the nearest dir,
+	//from the current dir up, that defines it, like git finds its repository
+	void setWalkLocal(bool walk);
+	
 	boost::filesystem::path getPathHome();
 	void printBashCompletion(const boost::filesystem::path& p, PathPart pathPart, const char* item);
 	std::string& getErrMsg();
 	void addBmk(const boost::filesystem::path& basePath, const char* name, const char* pathVal);
 	void rmBmk(const boost::filesystem::path& basePath, const char* name);
+	
+	//adds the bookmarks read from in, one "name=path" per line, in a single rewrite of the bookmarks file
+	//a message is put in errors for each line that can't be added; if ALL_OR_NOTHING, nothing is added if there is one
+	void addBmks(const boost::filesystem::path& basePath, std::istream& in, std::vector<std::string>& errors, const bool ALL_OR_NOTHING = false);
+	void exportBmks(const boost::filesystem::path& basePath, std::ostream& out);
+	
+	//puts in errors a message for each bookmark in basePath that does not lead to a dir
+	void checkBmks(const boost::filesystem::path& basePath, std::vector<std::string>& errors);
+	
+	//warms the caches used to complete in p: its bookmarks file and the status of its items
+	//budget is the max number of files that may be read or stat'ed
+	void prefetchDir(const boost::filesystem::path& p, unsigned long budget);
+	
+	//returns the names of the bookmarks in basePath that resolve to target or one of its ancestors
+	//NOTE: target must be an absolute path without symlinks, like the one from current_path()
+	std::vector<std::string> getBmksTo(const boost::filesystem::path& basePath, const boost::filesystem::path& target);
+	//same as getBmksTo, with the local bookmarks that lead to target; with setWalkLocal, those of its parent dirs are included too
+	//the bookmarks of excluded are not returned, but they still hide the same names in farther dirs
+	std::vector<std::string> getLocalBmksTo(const boost::filesystem::path& target, const boost::filesystem::path& excluded);
 }
\ No newline at end of file
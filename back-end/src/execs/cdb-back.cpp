@@ -1,7 +1,19 @@
 //Copyright 2018-2019 Patrick Laughrea
 
+#include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include <boost/filesystem.hpp>
 
@@ -12,7 +24,7 @@ using namespace std;
 namespace fs = boost::filesystem;
 
 #define APP_NAME "cdb"
-const char* USAGE = "Usage: " APP_NAME " [path=~] [-a name [path=.]|-l|-p|-r name]";
+const char* USAGE = "Usage: " APP_NAME " [path=~] [-a name [path=.]|-l|-p|-r name|-w|-A [-s]|-E|-c]";
 #define isOption(arg) (arg[0] == '-')
 
 #define EXIT_CD 0
@@ -23,11 +35,16 @@ const char* USAGE = "Usage: " APP_NAME " [path=~] [-a name [path=.]|-l|-p|-r nam
 [[noreturn]] void exitUsage();
 void resolveOption(const fs::path& basePath, int argc, char** argv, int indexOption);
 void checkArgCount(int argc, int indexOption, int min, int max);
+void startPrefetch(const fs::path& p);
 
 int main(int argc, char** argv) {
 	try {
+		const char* walkLocal = getenv("CDB_WALK_LOCAL");
+		setWalkLocal(walkLocal != nullptr && *walkLocal != '\0');
 		if (argc <= 1) {
-			cout << getPathHome().c_str() << endl;
+			auto pathHome = getPathHome();
+			startPrefetch(pathHome);
+			cout << pathHome.c_str() << endl;
 			return EXIT_CD;
 		}
 		fs::path p;
@@ -39,6 +56,7 @@ int main(int argc, char** argv) {
 			if (!resolvePath(p, argv[1]))
 				throw runtime_error(move(getErrMsg()));
 			if (argc == 2) {
+				startPrefetch(p);
 				cout << p.c_str() << endl;
 				return EXIT_CD;
 			}
@@ -84,6 +102,45 @@ void resolveOption(const fs::path& basePath, int argc, char** argv, int indexOpt
 		checkArgCount(argc, indexOption, 2, 2);
 		rmBmk(basePath, argv[indexOption + 1]);
 		exit(EXIT_DO_NOTHING);
+	} else if (optChar == 'A') {
+		//cdb <bmk> -A [-s], with lines "name=path" in stdin
+		checkArgCount(argc, indexOption, 1, 2);
+		bool allOrNothing = argc == indexOption + 2;
+		if (allOrNothing && strcmp(argv[indexOption + 1], "-s") != 0) {
+			opt = argv[indexOption + 1];
+			goto invalidOpt;
+		}
+		vector<string> errors;
+		addBmks(basePath, cin, errors, allOrNothing);
+		for (const auto& error : errors)
+			cerr << APP_NAME << ": error: " << error << endl;
+		if (errors.empty())
+			exit(EXIT_DO_NOTHING);
+		if (allOrNothing)
+			cerr << APP_NAME << ": no bookmark was added" << endl;
+		exit(EXIT_ERROR);
+	} else if (optChar == 'E') {
+		checkArgCount(argc, indexOption, 1, 1);
+		exportBmks(basePath, cout);
+		cout.flush();
+		exit(EXIT_ECHO);
+	} else if (optChar == 'c') {
+		checkArgCount(argc, indexOption, 1, 1);
+		vector<string> errors;
+		checkBmks(basePath, errors);
+		for (const auto& error : errors)
+			cerr << APP_NAME << ": error: " << error << endl;
+		exit(errors.empty() ? EXIT_DO_NOTHING : EXIT_ERROR);
+	} else if (optChar == 'w') {
+		//lists the bookmarks, in basePath and in the local stores, that lead to the current dir
+		checkArgCount(argc, indexOption, 1, 1);
+		auto currentPath = fs::current_path();
+		for (const auto& name : getBmksTo(basePath, currentPath))
+			cout << name << '\n';
+		for (const auto& name : getLocalBmksTo(currentPath, basePath))
+			cout << CHAR_ROOT_LOCAL << name << '\n';
+		cout.flush();
+		exit(EXIT_ECHO);
 	}
 invalidOpt:
 	cerr << APP_NAME << ": invalid option: " << opt << endl;
@@ -95,4 +152,42 @@ void checkArgCount(int argc, int indexOption, int min, int max) {
 		cerr << APP_NAME << ": too " << (argc < indexOption + min ? "few" : "many") << " arguments" << endl;
 		exitUsage();
 	}
+}
+
+//if the environment variable CDB_PREFETCH is set to a budget, forks a detached
+//process that runs prefetchDir on p with a low priority; the caller doesn't wait for it
+void startPrefetch(const fs::path& p) {
+	const char* env = getenv("CDB_PREFETCH");
+	if (env == nullptr || *env == '\0')
+		return;
+	char* end;
+	unsigned long budget = strtoul(env, &end, 10);
+	if (*end != '\0' || budget == 0)
+		return;
+	pid_t pid = fork();
+	if (pid != 0) {
+		if (pid > 0)
+			waitpid(pid, nullptr, 0);
+		return;
+	}
+	//the intermediate child exits right away so the prefetch is not a child of the shell
+	if (setsid() == -1 || fork() != 0)
+		_exit(EXIT_SUCCESS);
+	//the front end reads stdout until it is closed, so it must not be kept open
+	int fd = open("/dev/null", O_RDWR);
+	if (fd == -1)
+		_exit(EXIT_ERROR);
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	if (fd > STDERR_FILENO)
+		close(fd);
+	setpriority(PRIO_PROCESS, 0, 19);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13); //IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+#endif
+	try {
+		prefetchDir(p, budget);
+	} catch (...) {}
+	_exit(EXIT_SUCCESS);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 //Copyright 2018 Patrick Laughrea
 
+#include <cstdlib>
 #include <exception>
 
 #include <boost/filesystem.hpp>
@@ -12,6 +13,8 @@ namespace fs = boost::filesystem;
 
 int main(int argc, char** argv) {
 	try {
+		const char* walkLocal = getenv("CDB_WALK_LOCAL");
+		setWalkLocal(walkLocal != nullptr && *walkLocal != '\0');
 		if (argc != 2) {
 			if (argc != 1)
 				return 1;